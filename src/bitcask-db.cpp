@@ -7,6 +7,8 @@
 #include <iostream>
 #include <memory>
 #include <regex>
+#include <algorithm>
+#include <cstring>
 
 namespace bitcask
 {
@@ -16,6 +18,44 @@ namespace bitcask
         // return 3;
     }
 
+    timestamp_t currentTimestamp()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    bool isExpired(timestamp_t expiresAt, timestamp_t now)
+    {
+        return expiresAt != 0 && expiresAt <= now;
+    }
+
+    IndexEntry makeIndexEntry(offset_t offset, timestamp_t expiresAt, keySize_t keySize, void *keyData, valueSize_t valueSize)
+    {
+        IndexEntry entry = {offset, expiresAt, keySize, valueSize, {0}};
+        memcpy(entry.keyPrefix, keyData, std::min((size_t)keySize, sizeof(entry.keyPrefix)));
+        return entry;
+    }
+
+    /** The tag of a hash stored in the index buckets. The low bits of the hash already select the bucket. */
+    uint8_t hashTag(hash_t hash)
+    {
+        return hash >> 24;
+    }
+
+    /**
+     * Return a bit mask of the positions of the tags equal to the given tag.
+     * A bucket has only four slots, so a plain loop is as fast as any SIMD comparison.
+     */
+    uint32_t matchTags(const uint8_t *tags, int count, uint8_t tag)
+    {
+        uint32_t mask = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (tags[i] == tag)
+                mask |= 1u << i;
+        }
+        return mask;
+    }
+
     cpptrace::system_error errno_error(std::string &&what)
     {
         return cpptrace::system_error(errno, std::move(what));
@@ -145,42 +185,378 @@ namespace bitcask
         }
     }
 
+    /** Read buffers kept by the buffer pool in direct I/O mode */
+    const size_t readBufferSize = 64 * 1024;
+    const size_t maxIdleReadBuffers = 16;
+
+    /** Alignment of offsets, sizes and memory addresses for direct I/O */
+    const size_t directIoAlignment = 4096;
+
+    size_t alignDown(size_t value)
+    {
+        return value - value % directIoAlignment;
+    }
+
+    size_t alignUp(size_t value)
+    {
+        return alignDown(value + directIoAlignment - 1);
+    }
+
+    /**
+     * Read up to the given amount of data, stopping at EOF or once the file offset end is reached.
+     * Works for files opened for direct I/O, if buffer, size and offset are aligned. Returns the number of bytes read.
+     */
+    size_t pReadAligned(int fd, void *buf, size_t size, offset_t offset, size_t end)
+    {
+        size_t total = 0;
+        while (total < size && offset + total < end)
+        {
+            ssize_t n = pread(fd, ((uint8_t *)buf) + total, size - total, offset + total);
+            if (n == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                throw errno_error("pread");
+            }
+            if (n == 0)
+            {
+                // EOF is reached
+                break;
+            }
+            total += n;
+        }
+        return total;
+    }
+
+    AlignedBuffer::AlignedBuffer(size_t size)
+    {
+        this->size = size;
+        if (posix_memalign(&data, directIoAlignment, size))
+        {
+            throw cpptrace::runtime_error("failed to allocate aligned buffer");
+        }
+    }
+
+    std::unique_ptr<AlignedBuffer> BufferPool::acquire()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!idleBuffers.empty())
+            {
+                auto buffer = std::move(idleBuffers.back());
+                idleBuffers.pop_back();
+                return buffer;
+            }
+        }
+        return std::unique_ptr<AlignedBuffer>(new AlignedBuffer(bufferSize));
+    }
+
+    void BufferPool::release(std::unique_ptr<AlignedBuffer> buffer)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (idleBuffers.size() < maxIdleBuffers)
+        {
+            idleBuffers.push_back(std::move(buffer));
+        }
+    }
+
     struct IndexFileHeader
     {
         uint32_t buckets;
+        uint16_t keyPrefixSize;
     } __attribute((packed));
 
     struct LogEntryHeader
     {
         keySize_t keySize;
         valueSize_t valueSize;
+        timestamp_t expiresAt;
+    } __attribute__((packed));
+
+    struct LogFileHeader
+    {
+        uint32_t magic;
+        uint32_t version;
     } __attribute__((packed));
 
+    static_assert(sizeof(LogFileHeader) == logHeaderSize, "log file header size");
+
+    const uint32_t logFileMagic = 0x4b534342; // "BCSK"
+
+    /** Version of the log file format, to be increased whenever the format of the entries changes */
+    const uint32_t logFileVersion = 1;
+
+    bool isSupportedFormat(const LogFileHeader &header)
+    {
+        return header.magic == logFileMagic && header.version == logFileVersion;
+    }
+
+    /** Byte used to pad the current log file to the direct I/O alignment. A header consisting of padding marks the end of the log */
+    const uint8_t paddingByte = 0xFF;
+
+    bool isPadding(const LogEntryHeader &header)
+    {
+        auto bytes = reinterpret_cast<const uint8_t *>(&header);
+        return std::all_of(bytes, bytes + sizeof(header), [](uint8_t b)
+                           { return b == paddingByte; });
+    }
+
+    /**
+     * Sequential reader for the entries of a log file. The file is read in large aligned chunks,
+     * which works for files opened for direct I/O as well.
+     */
+    class LogScanner
+    {
+    public:
+        LogEntryHeader header;
+        std::vector<uint8_t> key;
+
+        /** offset of the current entry */
+        offset_t offset = 0;
+
+        /** offset following the last complete entry. Entries start after the file header, so offsets are never zero */
+        offset_t end = logHeaderSize;
+
+        /** Open the log at the given offset. Throws if the file header does not match the supported format */
+        LogScanner(int fd, offset_t start = logHeaderSize) : end(start), fd(fd), chunk(chunkSize)
+        {
+            readFileSize();
+            checkFileHeader();
+        }
+
+        /**
+         * Pick up changes of the file size, for reading a log file while it is written.
+         * Returns true if the size changed.
+         */
+        bool refresh()
+        {
+            size_t previousSize = fileSize;
+            readFileSize();
+            if (fileSize == previousSize)
+            {
+                return false;
+            }
+
+            // the chunk might hold padding after the last entry, which is overwritten by later appends
+            chunkLength = 0;
+            if (previousSize == 0)
+            {
+                checkFileHeader();
+            }
+            return true;
+        }
+
+        /** Check if the file is empty, not even containing the file header */
+        bool empty()
+        {
+            return fileSize == 0;
+        }
+
+        /** Move to the next entry. Returns false at the end of the log, which is EOF, a truncated entry or padding */
+        bool next()
+        {
+            size_t pos = end;
+            if (!read(pos, &header, sizeof(header)) || isPadding(header))
+            {
+                return false;
+            }
+            pos += sizeof(header);
+
+            key.resize(header.keySize);
+            if (!read(pos, key.data(), header.keySize))
+            {
+                return false;
+            }
+            pos += header.keySize;
+
+            // skip value
+            pos += header.valueSize;
+            if (pos > fileSize) // truncated file
+            {
+                return false;
+            }
+
+            offset = end;
+            end = pos;
+            return true;
+        }
+
+        /** Read the value of the current entry */
+        void readValue(void *buf)
+        {
+            if (!read(offset + sizeof(header) + header.keySize, buf, header.valueSize))
+            {
+                throw cpptrace::logic_error("Unexpected EOF");
+            }
+        }
+
+    private:
+        static const size_t chunkSize = 1 << 20;
+        int fd;
+        size_t fileSize;
+        AlignedBuffer chunk;
+        size_t chunkOffset = 0;
+        size_t chunkLength = 0;
+
+        void readFileSize()
+        {
+            struct stat st;
+            if (fstat(fd, &st) == -1)
+            {
+                throw errno_error("read file size");
+            }
+            fileSize = st.st_size;
+        }
+
+        void checkFileHeader()
+        {
+            // a new log file is empty until the header is written
+            LogFileHeader fileHeader;
+            if (fileSize > 0 && (!read(0, &fileHeader, sizeof(fileHeader)) || !isSupportedFormat(fileHeader)))
+            {
+                throw cpptrace::runtime_error("unsupported log file format");
+            }
+        }
+
+        bool read(size_t pos, void *buf, size_t size)
+        {
+            if (pos + size > fileSize)
+            {
+                return false;
+            }
+
+            uint8_t *target = (uint8_t *)buf;
+            while (size > 0)
+            {
+                if (pos < chunkOffset || pos >= chunkOffset + chunkLength)
+                {
+                    chunkOffset = alignDown(pos);
+                    chunkLength = pReadAligned(fd, chunk.data, chunk.size, chunkOffset, fileSize);
+                    if (pos >= chunkOffset + chunkLength)
+                    {
+                        return false;
+                    }
+                }
+
+                size_t n = std::min(size, chunkOffset + chunkLength - pos);
+                memcpy(target, (uint8_t *)chunk.data + (pos - chunkOffset), n);
+                target += n;
+                pos += n;
+                size -= n;
+            }
+            return true;
+        }
+    };
+
+    int BitcaskDb::logFileFlags()
+    {
+        return directIo ? O_DIRECT : 0;
+    }
+
     BitcaskDb::Segment BitcaskDb::loadSegment(int nr)
     {
         Segment segment;
         segment.segmentNr = nr;
-        segment.logFileFd = ::open(logFileName(nr).c_str(), O_RDONLY);
+        segment.logFileFd = ::open(logFileName(nr).c_str(), O_RDONLY | logFileFlags());
         if (segment.logFileFd == -1)
         {
             throw errno_error("open log file " + logFileName(nr).string());
         }
+        try
+        {
+            checkLogFileHeader(segment.logFileFd, logFileName(nr));
+        }
+        catch (...)
+        {
+            ::close(segment.logFileFd);
+            throw;
+        }
+
+        IndexFile index;
+        if (loadIndex(nr, index))
+        {
+            std::promise<IndexFile> ready;
+            ready.set_value(index);
+            segment.index = ready.get_future().share();
+        }
+        return segment;
+    }
+
+    void BitcaskDb::checkLogFileHeader(int fd, const std::filesystem::path &fileName)
+    {
+        struct stat st;
+        if (fstat(fd, &st) == -1)
+        {
+            throw errno_error("read file size");
+        }
+
+        // a log file is empty until the header is written
+        if (st.st_size == 0)
+        {
+            return;
+        }
+
+        LogFileHeader header;
+        if ((size_t)st.st_size < sizeof(header))
+        {
+            throw cpptrace::runtime_error("unsupported log file format: " + fileName.string());
+        }
+        readLog(fd, &header, sizeof(header), 0);
+        if (!isSupportedFormat(header))
+        {
+            throw cpptrace::runtime_error("unsupported log file format: " + fileName.string());
+        }
+    }
+
+    bool BitcaskDb::loadIndex(int segmentNr, IndexFile &index)
+    {
+        auto fileName = indexFileName(segmentNr);
+        int fd = ::open(fileName.c_str(), O_RDONLY);
+        if (fd == -1)
+        {
+            if (errno == ENOENT)
+            {
+                return false;
+            }
+            throw errno_error("open index file " + fileName.string());
+        }
 
-        segment.indexFileFd = ::open(indexFileName(nr).c_str(), O_RDONLY);
-        if (segment.indexFileFd == -1)
+        // the index file is written completely before being renamed, but check it anyways
+        struct stat st;
+        if (fstat(fd, &st) == -1)
         {
-            throw errno_error("open index file " + indexFileName(nr).string());
+            throw errno_error("read file size");
         }
 
         IndexFileHeader header;
-        pReadFully(segment.indexFileFd, &header, sizeof(IndexFileHeader), 0);
-        segment.indexBucketCount = header.buckets;
-        return segment;
+        bool valid = (size_t)st.st_size >= sizeof(header) && pReadFully(fd, &header, sizeof(header), 0) && header.keyPrefixSize == BITCASK_KEY_PREFIX_SIZE && header.buckets > 0 && (size_t)st.st_size == sizeof(header) + header.buckets * bucketSize();
+        if (!valid)
+        {
+            if (::close(fd) == -1)
+            {
+                throw errno_error("close index file");
+            }
+            return false;
+        }
+
+        index.fd = fd;
+        index.bucketCount = header.buckets;
+        return true;
     }
 
-    void BitcaskDb::open(const std::filesystem::path &path)
+    void BitcaskDb::open(const std::filesystem::path &path, bool directIo)
     {
         dbPath = path;
+        nextSegmentNr = 0;
+        this->directIo = directIo;
+        if (directIo)
+        {
+            writeBuffer.reset(new AlignedBuffer(writeBufferSize));
+            readBufferPool.reset(new BufferPool(readBufferSize, maxIdleReadBuffers));
+        }
         std::filesystem::create_directories(path);
         std::vector<int> logFileNumbers;
 
@@ -217,7 +593,152 @@ namespace bitcask
         }
         std::reverse(segments.begin(), segments.end());
 
+        // Missing or incomplete index files are rebuilt in the background, newest first.
+        // Lookups wait for the index of a segment when they reach it.
+        std::deque<IndexBuildTask> tasks;
+        for (auto &segment : segments)
+        {
+            if (!segment.index.valid())
+            {
+                IndexBuildTask task;
+                task.segmentNr = segment.segmentNr;
+                segment.index = task.done.get_future().share();
+                tasks.push_back(std::move(task));
+            }
+        }
+
         openCurrentLogFile();
+        try
+        {
+            indexBuilders.start(*this, std::move(tasks));
+            indexCurrentLogFile();
+        }
+        catch (...)
+        {
+            indexBuilders.stop();
+            throw;
+        }
+    }
+
+    struct BitcaskDb::IndexBuilders::Queue
+    {
+        std::mutex mutex;
+        std::deque<IndexBuildTask> tasks;
+        bool stopped = false;
+    };
+
+    void BitcaskDb::IndexBuilders::start(const BitcaskDb &db, std::deque<IndexBuildTask> tasks)
+    {
+        if (tasks.empty())
+        {
+            return;
+        }
+
+        auto queue = std::make_shared<Queue>();
+        queue->tasks = std::move(tasks);
+        this->queue = queue;
+
+        // the builders work on an instance of their own, without a current log file
+        auto builder = std::make_shared<BitcaskDb>();
+        builder->dbPath = db.dbPath;
+        builder->directIo = db.directIo;
+        if (db.directIo)
+        {
+            builder->readBufferPool.reset(new BufferPool(readBufferSize, maxIdleReadBuffers));
+        }
+
+        size_t threadCount = std::min((size_t)std::max(1u, std::thread::hardware_concurrency()), queue->tasks.size());
+        for (size_t i = 0; i < threadCount; i++)
+        {
+            threads.emplace_back([queue, builder]()
+                                 {
+                while (true)
+                {
+                    IndexBuildTask task;
+                    {
+                        std::lock_guard<std::mutex> lock(queue->mutex);
+                        if (queue->stopped || queue->tasks.empty())
+                        {
+                            return;
+                        }
+                        task = std::move(queue->tasks.front());
+                        queue->tasks.pop_front();
+                    }
+
+                    try
+                    {
+                        // the indexes of older segments might not be available yet, so keep expired entries
+                        builder->buildIndexFile(task.segmentNr, false);
+                        IndexFile index;
+                        if (!builder->loadIndex(task.segmentNr, index))
+                        {
+                            throw cpptrace::runtime_error("rebuilt index file of segment " + std::to_string(task.segmentNr) + " is invalid");
+                        }
+                        task.done.set_value(index);
+                    }
+                    catch (...)
+                    {
+                        task.done.set_exception(std::current_exception());
+                    }
+                } });
+        }
+    }
+
+    void BitcaskDb::IndexBuilders::wait()
+    {
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        threads.clear();
+
+        if (queue)
+        {
+            // tasks left over after stopping are never done
+            for (auto &task : queue->tasks)
+            {
+                task.done.set_exception(std::make_exception_ptr(cpptrace::runtime_error("index rebuild of segment " + std::to_string(task.segmentNr) + " cancelled")));
+            }
+            queue.reset();
+        }
+    }
+
+    void BitcaskDb::IndexBuilders::stop()
+    {
+        if (queue)
+        {
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->stopped = true;
+        }
+        wait();
+    }
+
+    BitcaskDb::IndexBuilders &BitcaskDb::IndexBuilders::operator=(IndexBuilders &&other)
+    {
+        if (this != &other)
+        {
+            stop();
+            queue = std::move(other.queue);
+            threads = std::move(other.threads);
+        }
+        return *this;
+    }
+
+    BitcaskDb::IndexBuilders::~IndexBuilders()
+    {
+        stop();
+    }
+
+    bool BitcaskDb::segmentIndexesReady()
+    {
+        for (auto &segment : segments)
+        {
+            if (segment.index.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            {
+                return false;
+            }
+        }
+        return true;
     }
 
     struct AutoCloseFd
@@ -247,41 +768,83 @@ namespace bitcask
         operator int() const { return fd; }
     };
 
-    void BitcaskDb::writeToIndex(int fd, int bucketCount, hash_t hash, offset_t offset)
+    /** Flush a file or directory to disk. Syncing a directory makes the links and renames in it durable */
+    void syncPath(const std::filesystem::path &path)
+    {
+        AutoCloseFd fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1)
+        {
+            throw errno_error("open " + path.string());
+        }
+        if (fsync(fd) == -1)
+        {
+            throw errno_error("fsync " + path.string());
+        }
+    }
+
+    bool BitcaskDb::writeToIndex(int fd, int logFd, int bucketCount, hash_t hash, keySize_t keySize, void *keyData, IndexEntry entry)
     {
         int bucket = hash % bucketCount;
 
         // read bucket
-        std::unique_ptr<uint8_t> bucketData(new uint8_t[bucketSize()]);
+        std::unique_ptr<uint8_t[]> bucketData(new uint8_t[bucketSize()]);
         pReadFully(fd, bucketData, bucketSize(), sizeof(IndexFileHeader) + bucket * bucketSize());
 
+        uint8_t *tags = bucketTags(bucketData.get());
+        auto candidates = matchTags(tags, offsetsPerBucket, hashTag(hash));
+        int freeSlot = -1;
         for (int i = 0; i < offsetsPerBucket; i++)
         {
-            offset_t *offsetFromBucket = reinterpret_cast<offset_t *>(bucketData.get() + 1 + i * sizeof(offset_t));
-            if (*offsetFromBucket == 0)
+            IndexEntry *slot = bucketSlot(bucketData.get(), i);
+            if (slot->offset == 0)
             {
                 // empty slot
-                *offsetFromBucket = offset;
-                pwrite(fd, bucketData.get(), bucketSize(), sizeof(IndexFileHeader) + bucket * bucketSize());
-                return;
+                if (freeSlot == -1)
+                    freeSlot = i;
+                continue;
+            }
+
+            if ((candidates & (1u << i)) && keyMatches(logFd, *slot, keySize, keyData))
+            {
+                // replace the older entry of the same key
+                *slot = entry;
+                pWriteFully(fd, bucketData.get(), bucketSize(), sizeof(IndexFileHeader) + bucket * bucketSize());
+                return true;
             }
         }
 
-        // there was now free slot, throw for now
-        throw std::runtime_error("no free slot in bucket");
+        if (entry.offset == 0)
+        {
+            // nothing to remove
+            return true;
+        }
+
+        if (freeSlot == -1)
+        {
+            // there was no free slot, the index has to be rebuilt with more buckets
+            return false;
+        }
+
+        tags[freeSlot] = hashTag(hash);
+        *bucketSlot(bucketData.get(), freeSlot) = entry;
+        pWriteFully(fd, bucketData.get(), bucketSize(), sizeof(IndexFileHeader) + bucket * bucketSize());
+        return true;
     }
 
-    void BitcaskDb::buildIndexFile(int segmentNr)
+    void BitcaskDb::buildIndexFile(int segmentNr, bool dropExpired)
     {
-        AutoCloseFd logFd = ::open(logFileName(segmentNr).c_str(), O_RDONLY);
+        AutoCloseFd logFd = ::open(logFileName(segmentNr).c_str(), O_RDONLY | logFileFlags());
         if (logFd == -1)
         {
             throw errno_error("open log");
         }
+        auto now = currentTimestamp();
+        // the index is written to a temporary file, so a crash never leaves an incomplete index file
+        auto tmpFileName = indexFileName(segmentNr).string() + ".tmp";
         int bucketCount = 8;
         while (true)
         {
-            AutoCloseFd indexFd = ::open(indexFileName(segmentNr).c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+            AutoCloseFd indexFd = ::open(tmpFileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
             if (indexFd == -1)
             {
                 throw errno_error("failed to create index file");
@@ -295,38 +858,49 @@ namespace bitcask
             // write header
             IndexFileHeader header;
             header.buckets = bucketCount;
+            header.keyPrefixSize = BITCASK_KEY_PREFIX_SIZE;
             pWriteFully(indexFd, &header, sizeof(header), 0);
 
-            // seek log to beginning
-            if (lseek64(logFd, 1, SEEK_SET) == -1)
-            {
-                throw errno_error("seek to beginning");
-            }
-
+            LogScanner scanner(logFd);
             int keyCount = 0;
             while (true)
             {
-                auto offset = lseek64(logFd, 0, SEEK_CUR);
-
-                LogEntryHeader header;
-                auto bytesRead = readFully(logFd, &header, sizeof(header), false);
-
-                if (bytesRead < sizeof(header)) // EOF reached
+                if (!scanner.next()) // EOF reached
                 {
+                    if (fsync(indexFd) == -1)
+                    {
+                        throw errno_error("fsync " + tmpFileName);
+                    }
+                    if (std::rename(tmpFileName.c_str(), indexFileName(segmentNr).c_str()))
+                    {
+                        throw errno_error("rename " + tmpFileName);
+                    }
                     return;
                 }
 
-                std::unique_ptr<uint8_t> keyData(new uint8_t[header.keySize]);
-
-                bytesRead = readFully(logFd, keyData.get(), header.keySize);
-                auto pos = lseek64(logFd, header.valueSize, SEEK_CUR); // skip value
+                auto &header = scanner.header;
+                void *keyData = scanner.key.data();
+                auto h = hash(header.keySize, keyData);
 
-                auto h = hash(header.keySize, keyData.get());
+                IndexEntry entry = makeIndexEntry(scanner.offset, header.expiresAt, header.keySize, keyData, header.valueSize);
+                if (dropExpired && isExpired(header.expiresAt, now))
+                {
+                    // An expired entry only needs to be kept if it shadows an entry in an older segment.
+                    // Otherwise it is discarded, together with any earlier entry of the key in this segment.
+                    EntryLocation location;
+                    if (!findInSegments(h, header.keySize, keyData, location))
+                    {
+                        entry.offset = 0;
+                    }
+                }
 
-                writeToIndex(indexFd, bucketCount, h, offset);
+                if (!writeToIndex(indexFd, logFd, bucketCount, h, header.keySize, keyData, entry))
+                {
+                    break;
+                }
                 keyCount++;
 
-                if (keyCount >> bucketCount * 2)
+                if (keyCount > bucketCount * 2)
                 {
                     break;
                 }
@@ -338,6 +912,15 @@ namespace bitcask
 
     void BitcaskDb::rotateCurrentLogFile()
     {
+        // older indexes are required to drop expired entries from the new index
+        indexBuilders.wait();
+        flush();
+        if (::close(currentLogFile) == -1)
+        {
+            throw errno_error("close current.log");
+        }
+        currentLogFile = -1;
+
         auto segmentNr = nextSegmentNr++;
         // move current.log to next log file
         if (std::rename((dbPath / "current.log").c_str(), logFileName(segmentNr).c_str()))
@@ -346,86 +929,252 @@ namespace bitcask
         }
 
         buildIndexFile(segmentNr);
-        segments.push_front(loadSegment(segmentNr));
+        auto segment = loadSegment(segmentNr);
+        if (!segment.index.valid())
+        {
+            throw cpptrace::runtime_error("index file of segment " + std::to_string(segmentNr) + " is invalid");
+        }
+        segments.push_front(segment);
 
         currentOffsets.clear();
         openCurrentLogFile();
+        indexCurrentLogFile();
     }
 
-    void BitcaskDb::openCurrentLogFile()
+    void BitcaskDb::checkpoint(const std::filesystem::path &path)
     {
-        currentLogFile = ::open((dbPath / "current.log").c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-        if (currentLogFile == -1)
+        std::filesystem::create_directories(path);
+
+        // rebuilt index files are needed for the checkpoint
+        indexBuilders.wait();
+
+        // Determine the consistent prefix of the current log file before touching any segments.
+        // It includes the file header, which is written when the current log file is created.
+        offset_t currentSize = currentLogEnd;
+
+        // add sealed segments. These are immutable, so segments already present in the target are skipped
+        for (auto &segment : segments)
         {
-            throw errno_error("failed to open current.log");
+            for (auto &source : {logFileName(segment.segmentNr), indexFileName(segment.segmentNr)})
+            {
+                auto target = path / source.filename();
+                if (std::filesystem::exists(target))
+                {
+                    continue;
+                }
+
+                std::error_code ec;
+                std::filesystem::create_hard_link(source, target, ec);
+                if (ec)
+                {
+                    // Linking fails across file systems, fall back to copying. The copy is renamed once complete,
+                    // otherwise an interrupted copy would be skipped by later checkpoints.
+                    auto tmpTarget = target.string() + ".tmp";
+                    std::filesystem::copy_file(source, tmpTarget, std::filesystem::copy_options::overwrite_existing);
+                    syncPath(tmpTarget);
+                    std::filesystem::rename(tmpTarget, target);
+                }
+            }
         }
 
-        // read file size
-        struct stat st;
-        if (fstat(currentLogFile, &st) == -1)
+        // copy the current log file via the open file descriptor, so a concurrent rename does not matter
+        auto tmpFileName = path / "current.log.tmp";
         {
-            throw errno_error("read file size");
+            AutoCloseFd targetFd = ::open(tmpFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+            if (targetFd == -1)
+            {
+                throw errno_error("failed to create " + tmpFileName.string());
+            }
+
+            size_t chunkSize = 64 * 1024;
+            std::unique_ptr<uint8_t[]> chunk(new uint8_t[chunkSize]);
+            for (offset_t pos = 0; pos < currentSize;)
+            {
+                size_t n = std::min(chunkSize, (size_t)(currentSize - pos));
+                readLog(currentLogFile, chunk.get(), n, pos);
+                writeFully(targetFd, chunk.get(), n);
+                pos += n;
+            }
+
+            if (fsync(targetFd) == -1)
+            {
+                throw errno_error("fsync " + tmpFileName.string());
+            }
         }
 
-        // build index from log file
+        // replace the current log of a previous checkpoint atomically
+        if (std::rename(tmpFileName.c_str(), (path / "current.log").c_str()))
+        {
+            throw errno_error("rename " + tmpFileName.string());
+        }
 
-        // Seek to beginning, skip one byte to avoid zero offsets
-        if (lseek(currentLogFile, 1, SEEK_SET) == -1)
+        // make the links and renames durable
+        syncPath(path);
+    }
+
+    void BitcaskDb::openCurrentLogFile()
+    {
+        currentLogFile = ::open((dbPath / "current.log").c_str(), O_RDWR | O_CREAT | logFileFlags(), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+        if (currentLogFile == -1)
         {
-            throw errno_error("seek to beginning");
+            throw errno_error("failed to open current.log");
         }
+    }
 
-        while (true)
+    void BitcaskDb::indexCurrentLogFile()
+    {
+        // build index from log file
+        auto now = currentTimestamp();
+
+        // Dropping expired entries requires the indexes of the segments. Don't wait for indexes
+        // rebuilt in the background, keep the expired entries instead.
+        bool dropExpired = segmentIndexesReady();
+
+        LogScanner scanner(currentLogFile);
+        while (scanner.next())
         {
-            // get offset
-            auto offset = lseek64(currentLogFile, 0, SEEK_CUR);
-            if (offset == -1)
+            auto &header = scanner.header;
+            void *keyData = scanner.key.data();
+
+            IndexEntry entry = makeIndexEntry(scanner.offset, header.expiresAt, header.keySize, keyData, header.valueSize);
+            if (dropExpired && isExpired(header.expiresAt, now))
             {
-                throw errno_error("get offset");
+                // expired entries only need to be indexed if they shadow an entry in an older segment
+                EntryLocation location;
+                if (!findInSegments(hash(header.keySize, keyData), header.keySize, keyData, location))
+                {
+                    entry.offset = 0;
+                }
             }
+            insertToCurrentIndex(header.keySize, keyData, entry);
+        }
 
-            LogEntryHeader header;
-            auto bytesRead = readFully(currentLogFile, &header, sizeof(header), false);
+        // new entries are written after the last complete entry, a new log file starts with the header
+        currentLogEnd = scanner.empty() ? 0 : scanner.end;
 
-            if (bytesRead < sizeof(header)) // EOF or truncated file
+        if (directIo)
+        {
+            // remove padding, the write buffer assumes the file ends at the last entry
+            if (ftruncate(currentLogFile, currentLogEnd) == -1)
             {
-                if (lseek64(currentLogFile, offset, SEEK_SET) == -1)
-                {
-                    throw errno_error("seek to offset");
-                }
-                break;
+                throw errno_error("truncate current.log");
             }
 
-            std::unique_ptr<uint8_t> keyData(new uint8_t[header.keySize]);
+            // load the partially filled last block into the write buffer, it is rewritten on the next flush
+            writeBufferOffset = alignDown(currentLogEnd);
+            memset(writeBuffer->data, 0, directIoAlignment);
+            pReadAligned(currentLogFile, writeBuffer->data, directIoAlignment, writeBufferOffset, currentLogEnd);
+        }
+
+        if (currentLogEnd == 0)
+        {
+            LogFileHeader fileHeader = {logFileMagic, logFileVersion};
+            appendToCurrentLog(&fileHeader, sizeof(fileHeader));
+        }
+    }
+
+    void BitcaskDb::flush()
+    {
+        if (!directIo)
+        {
+            return;
+        }
+
+        size_t used = currentLogEnd - writeBufferOffset;
+        if (used == 0)
+        {
+            return;
+        }
+
+        // write the buffer padded to the alignment
+        size_t padded = alignUp(used);
+        memset((uint8_t *)writeBuffer->data + used, paddingByte, padded - used);
+        pWriteFully(currentLogFile, writeBuffer->data, padded, writeBufferOffset);
 
-            bytesRead = readFully(currentLogFile, keyData, header.keySize, false);
+        // remove the padding. After a crash before the truncation, reading the log stops at the padding
+        if (ftruncate(currentLogFile, currentLogEnd) == -1)
+        {
+            throw errno_error("truncate current.log");
+        }
+
+        // keep the partially filled last block, it is rewritten on the next flush
+        offset_t blockOffset = alignDown(currentLogEnd);
+        memmove(writeBuffer->data, (uint8_t *)writeBuffer->data + (blockOffset - writeBufferOffset), currentLogEnd - blockOffset);
+        writeBufferOffset = blockOffset;
+    }
+
+    void BitcaskDb::appendToCurrentLog(void *data, size_t size)
+    {
+        if (!directIo)
+        {
+            pWriteFully(currentLogFile, data, size, currentLogEnd);
+            currentLogEnd += size;
+            return;
+        }
 
-            if (bytesRead < header.keySize) // truncated file
+        size_t written = 0;
+        while (written < size)
+        {
+            size_t bufferPos = currentLogEnd - writeBufferOffset;
+            size_t n = std::min(size - written, writeBuffer->size - bufferPos);
+            memcpy((uint8_t *)writeBuffer->data + bufferPos, (uint8_t *)data + written, n);
+            written += n;
+            currentLogEnd += n;
+
+            if (currentLogEnd - writeBufferOffset == writeBuffer->size)
             {
-                if (lseek64(currentLogFile, offset, SEEK_SET) == -1)
-                {
-                    throw errno_error("seek to offset");
-                }
-                break;
+                // the buffer is full and ends at an aligned offset
+                pWriteFully(currentLogFile, writeBuffer->data, writeBuffer->size, writeBufferOffset);
+                writeBufferOffset = currentLogEnd;
             }
+        }
+    }
 
-            auto pos = lseek64(currentLogFile, header.valueSize, SEEK_CUR); // skip value
+    void BitcaskDb::readLog(int fd, void *buf, size_t size, offset_t offset)
+    {
+        if (!directIo)
+        {
+            pReadFully(fd, buf, size, offset);
+            return;
+        }
 
-            if (pos > st.st_size) // truncated file
+        if (fd == currentLogFile && offset + size > writeBufferOffset)
+        {
+            // serve the part held by the write buffer
+            offset_t bufferedStart = std::max(offset, writeBufferOffset);
+            memcpy((uint8_t *)buf + (bufferedStart - offset), (uint8_t *)writeBuffer->data + (bufferedStart - writeBufferOffset), offset + size - bufferedStart);
+            size = bufferedStart - offset;
+            if (size == 0)
             {
-                if (lseek64(currentLogFile, offset, SEEK_SET) == -1)
-                {
-                    throw errno_error("seek to offset");
-                }
-                break;
+                return;
             }
+        }
 
-            insertToCurrentIndex(header.keySize, keyData.get(), offset);
+        // read in pieces fitting a pool buffer, including the alignment at both ends
+        auto buffer = readBufferPool->acquire();
+        uint8_t *target = (uint8_t *)buf;
+        while (size > 0)
+        {
+            size_t start = alignDown(offset);
+            size_t length = std::min(alignUp(offset + size) - start, buffer->size);
+            size_t n = std::min(size, start + length - offset);
+            if (pReadAligned(fd, buffer->data, length, start, offset + n) < offset + n - start)
+            {
+                throw cpptrace::logic_error("Unexpected EOF");
+            }
+            memcpy(target, (uint8_t *)buffer->data + (offset - start), n);
+            target += n;
+            offset += n;
+            size -= n;
         }
+        readBufferPool->release(std::move(buffer));
     }
 
     void BitcaskDb::close()
     {
+        // don't wait for the rebuild of all missing indexes, they are rebuilt on the next open
+        indexBuilders.stop();
+        flush();
         if (::close(currentLogFile) == -1)
         {
             throw errno_error("close current.log");
@@ -439,7 +1188,17 @@ namespace bitcask
                 throw errno_error("close log file");
             }
 
-            if (::close(segment.indexFileFd) == -1)
+            // the index file is not open if rebuilding it failed or was cancelled
+            IndexFile index;
+            try
+            {
+                index = segment.index.get();
+            }
+            catch (...)
+            {
+                continue;
+            }
+            if (::close(index.fd) == -1)
             {
                 throw errno_error("close index file");
             }
@@ -451,86 +1210,128 @@ namespace bitcask
 
     void BitcaskDb::put(keySize_t keySize, void *keyData, valueSize_t valueSize, void *valueData)
     {
-        auto offset = lseek64(currentLogFile, 0, SEEK_CUR);
+        append(keySize, keyData, valueSize, valueData, 0);
+    }
 
-        LogEntryHeader header = {keySize, valueSize};
-        writeFully(currentLogFile, &header, sizeof(header));
-        writeFully(currentLogFile, keyData, keySize);
-        writeFully(currentLogFile, valueData, valueSize);
-        insertToCurrentIndex(keySize, keyData, offset);
+    void BitcaskDb::put(keySize_t keySize, void *keyData, valueSize_t valueSize, void *valueData, std::chrono::milliseconds ttl)
+    {
+        append(keySize, keyData, valueSize, valueData, currentTimestamp() + ttl.count());
+    }
+
+    void BitcaskDb::append(keySize_t keySize, void *keyData, valueSize_t valueSize, void *valueData, timestamp_t expiresAt)
+    {
+        auto offset = currentLogEnd;
+
+        LogEntryHeader header = {keySize, valueSize, expiresAt};
+        appendToCurrentLog(&header, sizeof(header));
+        appendToCurrentLog(keyData, keySize);
+        appendToCurrentLog(valueData, valueSize);
+        insertToCurrentIndex(keySize, keyData, makeIndexEntry(offset, expiresAt, keySize, keyData, valueSize));
     }
 
-    void BitcaskDb::insertToCurrentIndex(bitcask::keySize_t keySize, void *keyData, offset_t offset)
+    /**
+     * Insert an entry into the index of the current segment, replacing the entry of the same key if present.
+     * An entry with offset 0 removes the key from the index.
+     */
+    void BitcaskDb::insertToCurrentIndex(bitcask::keySize_t keySize, void *keyData, IndexEntry entry)
     {
         auto h = hash(keySize, keyData);
 
         // find existing entry in index
-        auto offsets = currentOffsets.find(hash(keySize, keyData));
-        for (; offsets != currentOffsets.end(); offsets++)
+        auto range = currentOffsets.equal_range(h);
+        for (auto it = range.first; it != range.second; it++)
         {
-            valueSize_t vSize;
-            if (compareKey(currentLogFile, offsets->second, keySize, keyData, vSize))
+            if (keyMatches(currentLogFile, it->second, keySize, keyData))
             {
-                offsets->second = offset;
+                if (entry.offset == 0)
+                    currentOffsets.erase(it);
+                else
+                    it->second = entry;
                 return;
             }
         }
 
         // if there is no existing entry, insert into index
-        currentOffsets.insert({h, offset});
+        if (entry.offset != 0)
+            currentOffsets.insert({h, entry});
     }
 
     std::unique_ptr<DataBuffer> BitcaskDb::get(keySize_t keySize, void *keyData)
     {
         auto keyHash = hash(keySize, keyData);
+        EntryLocation location;
+        bool found = false;
+
         // search current segment
-        auto offsets = currentOffsets.find(keyHash);
-        for (; offsets != currentOffsets.end(); offsets++)
+        auto range = currentOffsets.equal_range(keyHash);
+        for (auto it = range.first; it != range.second; it++)
         {
-            valueSize_t valueSize;
-            if (!compareKey(currentLogFile, offsets->second, keySize, keyData, valueSize))
+            if (keyMatches(currentLogFile, it->second, keySize, keyData))
             {
-                continue;
+                location.logFileFd = currentLogFile;
+                location.entry = it->second;
+                found = true;
+                break;
             }
-
-            // extract value
-            std::unique_ptr<DataBuffer> buffer(new DataBuffer(valueSize));
-            pReadFully(currentLogFile, buffer->data, valueSize, offsets->second + sizeof(LogEntryHeader) + keySize);
-            return buffer;
         }
 
         // search older segments
-        for (auto segment : segments)
+        if (!found && !findInSegments(keyHash, keySize, keyData, location))
+        {
+            return NULL;
+        }
+
+        // the expiry is known from the index, no need to read the value of expired entries
+        if (isExpired(location.entry.expiresAt, currentTimestamp()))
         {
-            int bucket = keyHash % segment.indexBucketCount;
+            return NULL;
+        }
+
+        // extract value, the size is known from the index
+        std::unique_ptr<DataBuffer> buffer(new DataBuffer(location.entry.valueSize));
+        readLog(location.logFileFd, buffer->data, location.entry.valueSize, location.entry.offset + sizeof(LogEntryHeader) + keySize);
+        return buffer;
+    }
+
+    bool BitcaskDb::findInSegments(hash_t keyHash, keySize_t keySize, void *keyData, EntryLocation &location)
+    {
+        std::unique_ptr<uint8_t[]> bucketData(new uint8_t[bucketSize()]);
+        auto tag = hashTag(keyHash);
+        for (auto &segment : segments)
+        {
+            // wait for the index to be rebuilt after opening the DB
+            auto &index = segment.index.get();
+
+            int bucket = keyHash % index.bucketCount;
 
             // read bucket
-            std::unique_ptr<uint8_t> bucketData(new uint8_t[bucketSize()]);
-            pReadFully(segment.indexFileFd, bucketData, bucketSize(), sizeof(IndexFileHeader) + bucket * bucketSize());
+            pReadFully(index.fd, bucketData, bucketSize(), sizeof(IndexFileHeader) + bucket * bucketSize());
 
-            for (int i = 0; i < offsetsPerBucket; i++)
+            auto candidates = matchTags(bucketTags(bucketData.get()), offsetsPerBucket, tag);
+            for (int i = 0; candidates != 0; i++, candidates >>= 1)
             {
-                offset_t offset = *(reinterpret_cast<offset_t *>(bucketData.get() + 1 + i * sizeof(offset_t)));
-                if (offset != 0)
-                {
-                    valueSize_t valueSize;
-                    if (!compareKey(segment.logFileFd, offset, keySize, keyData, valueSize))
-                        continue;
-
-                    // extract value
-                    std::unique_ptr<DataBuffer> buffer(new DataBuffer(valueSize));
-                    pReadFully(segment.logFileFd, buffer->data, valueSize, offset + sizeof(LogEntryHeader) + keySize);
-                    return buffer;
-                }
+                if (!(candidates & 1))
+                    continue;
+
+                IndexEntry *entry = bucketSlot(bucketData.get(), i);
+                if (entry->offset == 0)
+                    continue;
+
+                if (!keyMatches(segment.logFileFd, *entry, keySize, keyData))
+                    continue;
+
+                location.logFileFd = segment.logFileFd;
+                location.entry = *entry;
+                return true;
             }
         }
-        return NULL;
+        return false;
     }
 
     bool BitcaskDb::compareKey(int fd, offset_t offset, keySize_t keySize, void *keyData, valueSize_t &valueSize)
     {
         LogEntryHeader header;
-        pReadFully(fd, reinterpret_cast<char *>(&header), sizeof(header), offset);
+        readLog(fd, reinterpret_cast<char *>(&header), sizeof(header), offset);
         valueSize = header.valueSize;
 
         if (header.keySize != keySize)
@@ -539,16 +1340,255 @@ namespace bitcask
         }
 
         // read key
-        std::unique_ptr<uint8_t> keyFromFile(new uint8_t[keySize]);
-        pReadFully(fd, keyFromFile, keySize, offset + sizeof(header));
+        std::unique_ptr<uint8_t[]> keyFromFile(new uint8_t[keySize]);
+        readLog(fd, keyFromFile.get(), keySize, offset + sizeof(header));
         return memcmp(keyFromFile.get(), keyData, keySize) == 0;
     }
 
+    bool BitcaskDb::keyMatches(int fd, const IndexEntry &entry, keySize_t keySize, void *keyData)
+    {
+        if (entry.keySize != keySize)
+        {
+            return false;
+        }
+
+        if (memcmp(entry.keyPrefix, keyData, std::min((size_t)keySize, sizeof(entry.keyPrefix))) != 0)
+        {
+            return false;
+        }
+
+        if (keySize <= sizeof(entry.keyPrefix))
+        {
+            // the whole key is stored inline
+            return true;
+        }
+
+        valueSize_t valueSize;
+        return compareKey(fd, entry.offset, keySize, keyData, valueSize);
+    }
+
+    int ChangeStream::openLogFile(int segmentNr, bool &sealed)
+    {
+        auto logFileName = dbPath / (std::to_string(segmentNr) + ".log");
+        sealed = true;
+        int fd = ::open(logFileName.c_str(), O_RDONLY);
+        if (fd != -1 || errno != ENOENT)
+        {
+            if (fd == -1)
+            {
+                throw errno_error("open log file " + logFileName.string());
+            }
+            return fd;
+        }
+
+        // not rotated yet, use the current log file
+        sealed = false;
+        fd = ::open((dbPath / "current.log").c_str(), O_RDONLY);
+        if (fd == -1)
+        {
+            if (errno == ENOENT)
+            {
+                return -1;
+            }
+            throw errno_error("open current.log");
+        }
+
+        // the current log file might have been rotated before it was opened, use the segment in that case
+        if (std::filesystem::exists(logFileName))
+        {
+            if (::close(fd) == -1)
+            {
+                throw errno_error("close current.log");
+            }
+            return openLogFile(segmentNr, sealed);
+        }
+        return fd;
+    }
+
+    ChangeStream::ChangeStream(const std::filesystem::path &dbPath, LogPosition position) : dbPath(dbPath), currentPosition(position)
+    {
+    }
+
+    ChangeStream::~ChangeStream()
+    {
+        scanner.reset();
+        if (logFd != -1)
+        {
+            ::close(logFd);
+        }
+    }
+
+    void ChangeStream::closeLogFile()
+    {
+        scanner.reset();
+        int fd = logFd;
+        logFd = -1;
+        if (::close(fd) == -1)
+        {
+            throw errno_error("close log file");
+        }
+    }
+
+    size_t ChangeStream::read(std::vector<ChangeRecord> &records, size_t maxRecords)
+    {
+        size_t count = 0;
+        while (count < maxRecords)
+        {
+            if (!scanner)
+            {
+                logFd = openLogFile(currentPosition.segmentNr, sealed);
+                if (logFd == -1)
+                {
+                    break;
+                }
+
+                // read records in large chunks
+                scanner.reset(new LogScanner(logFd, currentPosition.offset));
+            }
+
+            while (count < maxRecords && scanner->next())
+            {
+                ChangeRecord record;
+                record.position = {currentPosition.segmentNr, scanner->offset};
+                record.key = std::string((char *)scanner->key.data(), scanner->header.keySize);
+                record.value.resize(scanner->header.valueSize);
+                scanner->readValue(record.value.data());
+                record.expiresAt = scanner->header.expiresAt;
+                records.push_back(std::move(record));
+
+                currentPosition.offset = scanner->end;
+                count++;
+            }
+
+            if (count == maxRecords)
+            {
+                break;
+            }
+
+            if (!sealed)
+            {
+                // The end of the current log file is reached. The open file becomes the segment once it is
+                // rotated, so check for the rotation first, then pick up the entries appended until then.
+                sealed = std::filesystem::exists(dbPath / (std::to_string(currentPosition.segmentNr) + ".log"));
+                if (scanner->refresh())
+                {
+                    continue;
+                }
+                if (!sealed)
+                {
+                    break;
+                }
+            }
+
+            // the segment is read completely, continue with the next one
+            closeLogFile();
+            currentPosition = {currentPosition.segmentNr + 1, logHeaderSize};
+        }
+        return count;
+    }
+
+    void BitcaskFollower::open(const std::filesystem::path &leaderPath, const std::filesystem::path &replicaPath)
+    {
+        this->replicaPath = replicaPath;
+        db.open(replicaPath);
+
+        LogPosition position = logStart;
+        AutoCloseFd fd = ::open(positionFileName().c_str(), O_RDONLY);
+        if (fd != -1)
+        {
+            readFully(fd, &position, sizeof(position));
+        }
+        else if (errno != ENOENT)
+        {
+            throw errno_error("open " + positionFileName().string());
+        }
+        stream.reset(new ChangeStream(leaderPath, position));
+    }
+
+    size_t BitcaskFollower::poll(size_t maxRecords)
+    {
+        auto segmentNr = stream->position().segmentNr;
+        std::vector<ChangeRecord> records;
+        stream->read(records, maxRecords);
+        if (records.empty() && stream->position().segmentNr == segmentNr)
+        {
+            // nothing to apply or to store
+            return 0;
+        }
+
+        for (auto &record : records)
+        {
+            // mirror the rotations of the leader, one per segment including empty ones
+            for (; segmentNr < record.position.segmentNr; segmentNr++)
+            {
+                rotateReplica();
+            }
+            db.append(record.key.size(), record.key.data(), record.value.size(), record.value.data(), record.expiresAt);
+        }
+        for (; segmentNr < stream->position().segmentNr; segmentNr++)
+        {
+            rotateReplica();
+        }
+
+        // The records are durably applied before the position is stored. After a crash, they are applied again, which does no harm
+        syncReplica();
+        writePosition();
+        return records.size();
+    }
+
+    void BitcaskFollower::rotateReplica()
+    {
+        // the rotated log file has to be durable before a position following it is stored
+        syncReplica();
+        db.rotateCurrentLogFile();
+    }
+
+    void BitcaskFollower::syncReplica()
+    {
+        db.flush();
+        if (fsync(db.currentLogFile) == -1)
+        {
+            throw errno_error("fsync current.log");
+        }
+    }
+
+    void BitcaskFollower::writePosition()
+    {
+        auto tmpFileName = replicaPath / "follower.pos.tmp";
+        {
+            AutoCloseFd fd = ::open(tmpFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+            if (fd == -1)
+            {
+                throw errno_error("failed to create " + tmpFileName.string());
+            }
+            auto position = stream->position();
+            writeFully(fd, &position, sizeof(position));
+            if (fsync(fd) == -1)
+            {
+                throw errno_error("fsync " + tmpFileName.string());
+            }
+        }
+
+        if (std::rename(tmpFileName.c_str(), positionFileName().c_str()))
+        {
+            throw errno_error("rename " + tmpFileName.string());
+        }
+
+        // make the renames of the position file and of rotated log files durable
+        syncPath(replicaPath);
+    }
+
+    void BitcaskFollower::close()
+    {
+        db.close();
+        stream.reset();
+    }
+
     void BitcaskDb::dumpIndex()
     {
         for (auto &offset : currentOffsets)
         {
-            std::cout << offset.first << " " << offset.second << std::endl;
+            std::cout << offset.first << " " << offset.second.offset << " " << offset.second.expiresAt << std::endl;
         }
     }
 }
\ No newline at end of file
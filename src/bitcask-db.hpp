@@ -4,8 +4,22 @@
 #include <unordered_map>
 #include <filesystem>
 #include <queue>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <future>
+#include <thread>
 #include <cpptrace/cpptrace.hpp>
 
+/**
+ * BITCASK_KEY_PREFIX_SIZE is the number of key bytes stored inline in index entries. Keys up to this size
+ * are compared without reading the log file. It is set by the build, since it changes the layout of IndexEntry
+ * and every translation unit has to agree on it.
+ */
+#ifndef BITCASK_KEY_PREFIX_SIZE
+#error "BITCASK_KEY_PREFIX_SIZE must be defined by the build, see CMakeLists.txt"
+#endif
+
 namespace bitcask
 {
     typedef uint16_t keySize_t;
@@ -13,6 +27,20 @@ namespace bitcask
     typedef uint32_t hash_t;
     typedef uint32_t offset_t;
 
+    /** Milliseconds since the unix epoch. A value of 0 represents an entry which never expires */
+    typedef uint64_t timestamp_t;
+
+    /** Slot of an index, used both in the in-memory index of the current segment and in the index files */
+    struct IndexEntry
+    {
+        offset_t offset;
+        timestamp_t expiresAt;
+        keySize_t keySize;
+        valueSize_t valueSize;
+        /** first bytes of the key, padded with zeros */
+        uint8_t keyPrefix[BITCASK_KEY_PREFIX_SIZE];
+    } __attribute__((packed));
+
     struct DataBuffer
     {
         size_t size;
@@ -30,15 +58,120 @@ namespace bitcask
         }
     };
 
+    /** Memory aligned for direct I/O */
+    struct AlignedBuffer
+    {
+        size_t size;
+        void *data;
+
+        AlignedBuffer(size_t size);
+
+        ~AlignedBuffer()
+        {
+            free(data);
+        }
+    };
+
+    /** Pool of aligned buffers. Limits the memory kept for reads in direct I/O mode */
+    class BufferPool
+    {
+    public:
+        BufferPool(size_t bufferSize, size_t maxIdleBuffers) : bufferSize(bufferSize), maxIdleBuffers(maxIdleBuffers) {}
+
+        /** Get a buffer of the pool's buffer size. Larger reads are done in pieces of that size */
+        std::unique_ptr<AlignedBuffer> acquire();
+        void release(std::unique_ptr<AlignedBuffer> buffer);
+
+    private:
+        size_t bufferSize;
+        size_t maxIdleBuffers;
+        std::mutex mutex;
+        std::vector<std::unique_ptr<AlignedBuffer>> idleBuffers;
+    };
+
+    /**
+     * Position in the log of a database. The current log file is identified by the number
+     * of the segment it becomes when rotated, so positions stay valid across rotations.
+     */
+    struct LogPosition
+    {
+        int32_t segmentNr;
+        offset_t offset;
+    };
+
+    /** Size of the header at the start of each log file, which identifies the file format. Entries follow the header */
+    const offset_t logHeaderSize = 8;
+
+    /** Position of the first entry of a database */
+    const LogPosition logStart = {0, logHeaderSize};
+
+    struct ChangeRecord
+    {
+        LogPosition position;
+        std::string key;
+        std::string value;
+        timestamp_t expiresAt;
+    };
+
+    class LogScanner;
+
+    /**
+     * Reads the records written to a database, following the rotations of the current log file.
+     * The files are read directly, so the database may be open in another process. Records still
+     * held in the write buffer of a database in direct I/O mode are returned once flushed.
+     */
+    class ChangeStream
+    {
+    public:
+        ChangeStream(const std::filesystem::path &dbPath, LogPosition position = logStart);
+        ~ChangeStream();
+
+        /** Append up to maxRecords records to the given vector and return the number of records read */
+        size_t read(std::vector<ChangeRecord> &records, size_t maxRecords = 1024);
+
+        /** Position of the next record to be read */
+        LogPosition position() { return currentPosition; }
+
+    private:
+        std::filesystem::path dbPath;
+        LogPosition currentPosition;
+
+        /** The log file being read is kept open between reads, together with its scanner */
+        int logFd = -1;
+        bool sealed;
+        std::unique_ptr<LogScanner> scanner;
+
+        /** Open the log file of the given segment, which might still be the current log file. Returns -1 if it does not exist yet */
+        int openLogFile(int segmentNr, bool &sealed);
+        void closeLogFile();
+    };
+
     class BitcaskDb
     {
     public:
-        void open(const std::filesystem::path &dbPath);
+        BitcaskDb() = default;
+
+        /**
+         * Open the database. In direct I/O mode, the log files bypass the page cache. Appends are collected
+         * in an aligned write buffer, which is written when full or on flush(). Reads use an internal buffer pool.
+         */
+        void open(const std::filesystem::path &dbPath, bool directIo = false);
+
+        /** Write buffered appends to the current log file. Appends are written immediately if direct I/O is not used */
+        void flush();
+
         void put(keySize_t keySize, void *keyData, valueSize_t valueSize, void *valueData);
         void put(std::string key, std::string value)
         {
             this->put(key.size(), (void *)key.c_str(), value.size(), (void *)value.c_str());
         }
+
+        /** Put an entry which is treated as absent once the time to live has elapsed */
+        void put(keySize_t keySize, void *keyData, valueSize_t valueSize, void *valueData, std::chrono::milliseconds ttl);
+        void put(std::string key, std::string value, std::chrono::milliseconds ttl)
+        {
+            this->put(key.size(), (void *)key.c_str(), value.size(), (void *)value.c_str(), ttl);
+        }
         std::unique_ptr<DataBuffer> get(keySize_t keySize, void *keyData);
         std::unique_ptr<DataBuffer> get(const std::string &key)
         {
@@ -73,17 +206,62 @@ namespace bitcask
 
         void rotateCurrentLogFile();
 
+        /** Position following the last written entry, to start reading changes from */
+        LogPosition endPosition()
+        {
+            return {nextSegmentNr, currentLogEnd};
+        }
+
+        /**
+         * Create a snapshot of the database in the given directory, which can be opened as database.
+         * Sealed segments are hard linked (or copied if the directory is on another file system),
+         * the current log file is copied up to the last written entry.
+         * If the directory contains a previous checkpoint, only segments not present yet are added,
+         * allowing incremental backups.
+         * The copy of the current log file is done on the calling thread, so writes wait for it to complete.
+         */
+        void checkpoint(const std::filesystem::path &path);
+
     private:
+        friend class BitcaskFollower;
+
         std::filesystem::path dbPath;
-        std::unordered_multimap<hash_t, offset_t> currentOffsets;
-        int currentLogFile;
+        std::unordered_multimap<hash_t, IndexEntry> currentOffsets;
+        int currentLogFile = -1;
         bool compareKey(int fd, offset_t offset, keySize_t keySize, void *keyData, valueSize_t &valueSize);
-        void insertToCurrentIndex(bitcask::keySize_t keySize, void *keyData, offset_t offset);
+
+        /** Check if the index entry belongs to the given key. The log file is only read if the key is longer than the inline prefix. */
+        bool keyMatches(int fd, const IndexEntry &entry, keySize_t keySize, void *keyData);
+        void insertToCurrentIndex(bitcask::keySize_t keySize, void *keyData, IndexEntry entry);
+        void append(keySize_t keySize, void *keyData, valueSize_t valueSize, void *valueData, timestamp_t expiresAt);
 
         int nextSegmentNr = 0;
 
+        bool directIo = false;
+        int logFileFlags();
+
+        /** offset of the end of the last entry in the current log file */
+        offset_t currentLogEnd;
+
+        /** In direct I/O mode, the write buffer holds the current log file from writeBufferOffset to currentLogEnd */
+        size_t writeBufferSize = 1 << 20;
+        std::unique_ptr<AlignedBuffer> writeBuffer;
+        offset_t writeBufferOffset;
+        std::unique_ptr<BufferPool> readBufferPool;
+
+        void appendToCurrentLog(void *data, size_t size);
+
+        /** Read from a log file, taking care of the alignment required by direct I/O and of the write buffer */
+        void readLog(int fd, void *buf, size_t size, offset_t offset);
+
         void openCurrentLogFile();
-        void buildIndexFile(int logFileNr);
+        void indexCurrentLogFile();
+
+        /**
+         * Build the index file of a segment. Expired entries are only dropped if dropExpired is set,
+         * which requires the indexes of all older segments to be available.
+         */
+        void buildIndexFile(int logFileNr, bool dropExpired = true);
 
         std::filesystem::path logFileName(int nr)
         {
@@ -94,24 +272,135 @@ namespace bitcask
             return dbPath / (std::to_string(nr) + ".idx");
         }
 
+        /**
+         * A bucket consists of a flag byte, one hash tag byte per slot and the slots.
+         * The tags allow to match all slots of a bucket at once.
+         */
         int offsetsPerBucket = 4;
         int bucketSize()
         {
-            return 1 + offsetsPerBucket * sizeof(offset_t);
+            return 1 + offsetsPerBucket + offsetsPerBucket * sizeof(IndexEntry);
+        }
+        uint8_t *bucketTags(uint8_t *bucketData)
+        {
+            return bucketData + 1;
         }
-        void writeToIndex(int fd, int bucketCount, hash_t hash, offset_t offset);
+        IndexEntry *bucketSlot(uint8_t *bucketData, int i)
+        {
+            return reinterpret_cast<IndexEntry *>(bucketData + 1 + offsetsPerBucket + i * sizeof(IndexEntry));
+        }
+
+        /**
+         * Write an entry to the index file, replacing the slot of the same key if present.
+         * An entry with offset 0 removes the key from the index. Returns false if the bucket is full.
+         */
+        bool writeToIndex(int fd, int logFd, int bucketCount, hash_t hash, keySize_t keySize, void *keyData, IndexEntry entry);
+
+        struct IndexFile
+        {
+            int fd;
+            int bucketCount;
+        };
 
         struct Segment
         {
             int segmentNr;
             int logFileFd;
-            int indexFileFd;
-            int indexBucketCount;
+
+            /** Ready once the index is loaded. Missing indexes are rebuilt in the background after opening the DB */
+            std::shared_future<IndexFile> index;
         };
 
         /** Segments without the current log file, in reverse order */
         std::deque<Segment> segments;
         Segment loadSegment(int nr);
+
+        /** Throw if the log file was written in an unsupported format */
+        void checkLogFileHeader(int fd, const std::filesystem::path &fileName);
+
+        /** Open the index file of a segment. Returns false if the index file is missing or incomplete */
+        bool loadIndex(int segmentNr, IndexFile &index);
+
+        struct IndexBuildTask
+        {
+            int segmentNr;
+            std::promise<IndexFile> done;
+        };
+
+        /**
+         * Threads rebuilding missing index files, started by open(). They only share the task queue and
+         * an instance of their own with the DB, so the DB can be moved while they run. Destroying or
+         * assigning the builders stops them.
+         */
+        class IndexBuilders
+        {
+        public:
+            IndexBuilders() = default;
+            IndexBuilders(IndexBuilders &&other) = default;
+            IndexBuilders &operator=(IndexBuilders &&other);
+            ~IndexBuilders();
+
+            void start(const BitcaskDb &db, std::deque<IndexBuildTask> tasks);
+
+            /** Wait until all tasks are done */
+            void wait();
+
+            /** Let the threads finish their current task and fail the remaining ones */
+            void stop();
+
+        private:
+            struct Queue;
+            std::shared_ptr<Queue> queue;
+            std::vector<std::thread> threads;
+        };
+        IndexBuilders indexBuilders;
+
+        /** Check if the indexes of all segments are loaded, without waiting */
+        bool segmentIndexesReady();
+
+        struct EntryLocation
+        {
+            int logFileFd;
+            IndexEntry entry;
+        };
+
+        /** Search the segments, newest to oldest, for the latest entry of the given key. Expired entries are found as well. */
+        bool findInSegments(hash_t keyHash, keySize_t keySize, void *keyData, EntryLocation &location);
+    };
+
+    /**
+     * Keeps a read only replica of a database up to date by applying its change stream. The replica is
+     * rotated once for every segment of the leader. The position in the change stream is stored in the
+     * replica directory after the applied records are synced, so following resumes after a restart.
+     */
+    class BitcaskFollower
+    {
+    public:
+        void open(const std::filesystem::path &leaderPath, const std::filesystem::path &replicaPath);
+
+        /** Apply up to maxRecords new records of the leader to the replica. Returns the number of applied records */
+        size_t poll(size_t maxRecords = 1024);
+
+        /** The replica, to be used for reads only */
+        BitcaskDb &replica()
+        {
+            return db;
+        }
+
+        void close();
+
+    private:
+        BitcaskDb db;
+        std::filesystem::path replicaPath;
+        std::unique_ptr<ChangeStream> stream;
+
+        std::filesystem::path positionFileName()
+        {
+            return replicaPath / "follower.pos";
+        }
+        void writePosition();
+        void rotateReplica();
+        void syncReplica();
     };
 
     struct BitcaskKey
@@ -1,5 +1,7 @@
 #include "bitcask-db.hpp"
 #include "test.hpp"
+#include <thread>
+#include <fstream>
 
 TEST(OpenDB, HappyFlow)
 {
@@ -74,3 +76,424 @@ TEST(OpenDB, RotateCurrentLog)
     ASSERT_FALSE(db.get("foo2", result));
     db.close();
 }
+
+TEST(OpenDB, RejectUnknownLogFormat)
+{
+    auto dir = createTestDataDir();
+    bitcask::BitcaskDb db;
+    db.open(dir);
+    db.put("foo", "bar");
+    db.rotateCurrentLogFile();
+    db.close();
+
+    // overwrite the header of the segment
+    {
+        std::fstream file(dir / "0.log", std::ios::in | std::ios::out | std::ios::binary);
+        file.write("XXXX", 4);
+    }
+    ASSERT_ANY_THROW(db.open(dir));
+}
+
+TEST(OpenDB, RotateManyKeys)
+{
+    auto dir = createTestDataDir();
+    bitcask::BitcaskDb db;
+    db.open(dir);
+
+    // more keys than fit into the initial buckets of the index
+    for (int i = 0; i < 200; i++)
+    {
+        db.put("key" + std::to_string(i), "value" + std::to_string(i));
+    }
+    db.rotateCurrentLogFile();
+
+    for (int i = 0; i < 200; i++)
+    {
+        ASSERT_EQ(db.getString("key" + std::to_string(i)), "value" + std::to_string(i));
+    }
+    db.close();
+}
+
+TEST(OpenDB, Expiry)
+{
+    auto dir = createTestDataDir();
+    bitcask::BitcaskDb db;
+    db.open(dir);
+
+    db.put("foo", "bar");
+    db.put("short", "lived", std::chrono::milliseconds(1));
+    db.put("long", "lived", std::chrono::hours(1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+    std::string result;
+    ASSERT_FALSE(db.get("short", result));
+    ASSERT_EQ(db.getString("long"), "lived");
+
+    db.rotateCurrentLogFile();
+    ASSERT_FALSE(db.get("short", result));
+    ASSERT_EQ(db.getString("long"), "lived");
+
+    // an expired entry hides the entries of older segments
+    db.put("foo", "baz", std::chrono::milliseconds(1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    ASSERT_FALSE(db.get("foo", result));
+    db.close();
+
+    db = bitcask::BitcaskDb();
+    db.open(dir);
+    ASSERT_FALSE(db.get("foo", result));
+    db.rotateCurrentLogFile();
+    ASSERT_FALSE(db.get("foo", result));
+    ASSERT_FALSE(db.get("short", result));
+    ASSERT_EQ(db.getString("long"), "lived");
+    db.close();
+}
+
+TEST(OpenDB, Checkpoint)
+{
+    auto dir = createTestDataDir();
+    auto backupDir = createTestDataDir();
+    bitcask::BitcaskDb db;
+    db.open(dir);
+
+    db.put("foo", "bar");
+    db.rotateCurrentLogFile();
+    db.put("foo1", "bar1");
+    db.checkpoint(backupDir);
+
+    // sealed segments are hard linked
+    struct stat st;
+    stat((backupDir / "0.log").c_str(), &st);
+    ASSERT_EQ(st.st_nlink, 2);
+
+    db.put("foo2", "bar2");
+    db.rotateCurrentLogFile();
+    db.put("foo3", "bar3");
+
+    bitcask::BitcaskDb backup;
+    backup.open(backupDir);
+    ASSERT_EQ(backup.getString("foo"), "bar");
+    ASSERT_EQ(backup.getString("foo1"), "bar1");
+    std::string result;
+    ASSERT_FALSE(backup.get("foo2", result));
+    backup.close();
+
+    // incremental checkpoint into the same directory
+    db.checkpoint(backupDir);
+    db.close();
+
+    backup = bitcask::BitcaskDb();
+    backup.open(backupDir);
+    ASSERT_EQ(backup.getString("foo"), "bar");
+    ASSERT_EQ(backup.getString("foo1"), "bar1");
+    ASSERT_EQ(backup.getString("foo2"), "bar2");
+    ASSERT_EQ(backup.getString("foo3"), "bar3");
+    backup.close();
+}
+
+TEST(OpenDB, CheckpointEmptyCurrentLog)
+{
+    auto dir = createTestDataDir();
+    auto backupDir = createTestDataDir();
+    bitcask::BitcaskDb db;
+    db.open(dir);
+
+    // fresh database
+    db.checkpoint(backupDir);
+
+    bitcask::BitcaskDb backup;
+    backup.open(backupDir);
+    std::string result;
+    ASSERT_FALSE(backup.get("foo", result));
+    backup.close();
+
+    // just rotated database
+    db.put("foo", "bar");
+    db.rotateCurrentLogFile();
+    db.checkpoint(backupDir);
+    db.close();
+
+    backup.open(backupDir);
+    ASSERT_EQ(backup.getString("foo"), "bar");
+    backup.close();
+}
+
+TEST(OpenDB, KeysLongerThanPrefix)
+{
+    auto dir = createTestDataDir();
+    bitcask::BitcaskDb db;
+    db.open(dir);
+
+    // keys sharing the inline prefix are distinguished by reading the log
+    std::string prefix(BITCASK_KEY_PREFIX_SIZE, 'k');
+    db.put(prefix + "1", "bar1");
+    db.put(prefix + "2", "bar2");
+    db.put(prefix, "bar");
+    ASSERT_EQ(db.getString(prefix + "1"), "bar1");
+    ASSERT_EQ(db.getString(prefix + "2"), "bar2");
+    ASSERT_EQ(db.getString(prefix), "bar");
+
+    db.rotateCurrentLogFile();
+    db.put(prefix + "2", "baz2");
+    ASSERT_EQ(db.getString(prefix + "1"), "bar1");
+    ASSERT_EQ(db.getString(prefix + "2"), "baz2");
+    ASSERT_EQ(db.getString(prefix), "bar");
+    std::string result;
+    ASSERT_FALSE(db.get(prefix + "3", result));
+    db.close();
+}
+
+TEST(OpenDB, DirectIo)
+{
+    auto dir = createTestDataDir();
+    bitcask::BitcaskDb db;
+    db.open(dir, true);
+
+    // write more than the write buffer holds
+    std::string large(100 * 1024, 'x');
+    for (int i = 0; i < 30; i++)
+    {
+        db.put("large" + std::to_string(i), large + std::to_string(i));
+    }
+    db.put("foo", "bar");
+    ASSERT_EQ(db.getString("large0"), large + "0");
+    ASSERT_EQ(db.getString("large29"), large + "29");
+    ASSERT_EQ(db.getString("foo"), "bar");
+
+    db.flush();
+    db.put("foo1", "bar1");
+    ASSERT_EQ(db.getString("foo"), "bar");
+    ASSERT_EQ(db.getString("foo1"), "bar1");
+
+    db.rotateCurrentLogFile();
+    db.put("foo2", "bar2");
+    ASSERT_EQ(db.getString("large5"), large + "5");
+    ASSERT_EQ(db.getString("foo1"), "bar1");
+    ASSERT_EQ(db.getString("foo2"), "bar2");
+    db.close();
+
+    // the padding is not left in the log
+    db = bitcask::BitcaskDb();
+    db.open(dir);
+    ASSERT_EQ(db.getString("foo2"), "bar2");
+    db.close();
+
+    // padding left by a crash before the truncation is ignored
+    {
+        std::ofstream out(dir / "current.log", std::ios::binary | std::ios::app);
+        out << std::string(100, (char)0xFF);
+    }
+    db = bitcask::BitcaskDb();
+    db.open(dir, true);
+    ASSERT_EQ(db.getString("foo2"), "bar2");
+    db.put("foo3", "bar3");
+    db.close();
+
+    db = bitcask::BitcaskDb();
+    db.open(dir, true);
+    ASSERT_EQ(db.getString("large0"), large + "0");
+    ASSERT_EQ(db.getString("foo2"), "bar2");
+    ASSERT_EQ(db.getString("foo3"), "bar3");
+    db.close();
+}
+
+TEST(ChangeStream, FollowsRotation)
+{
+    auto dir = createTestDataDir();
+    bitcask::BitcaskDb db;
+    db.open(dir);
+
+    db.put("foo", "bar");
+    db.put("foo1", "bar1");
+
+    bitcask::ChangeStream stream(dir);
+    std::vector<bitcask::ChangeRecord> records;
+    ASSERT_EQ(stream.read(records, 1), 1);
+    ASSERT_EQ(records[0].key, "foo");
+    ASSERT_EQ(records[0].value, "bar");
+
+    db.rotateCurrentLogFile();
+    db.put("foo2", "bar2", std::chrono::hours(1));
+
+    ASSERT_EQ(stream.read(records), 2);
+    ASSERT_EQ(records[1].key, "foo1");
+    ASSERT_EQ(records[1].position.segmentNr, 0);
+    ASSERT_EQ(records[2].key, "foo2");
+    ASSERT_EQ(records[2].value, "bar2");
+    ASSERT_EQ(records[2].position.segmentNr, 1);
+    ASSERT_NE(records[2].expiresAt, 0);
+    ASSERT_EQ(stream.read(records), 0);
+
+    // start reading at the end of the log
+    bitcask::ChangeStream tail(dir, db.endPosition());
+    db.put("foo3", "bar3");
+    records.clear();
+    ASSERT_EQ(tail.read(records), 1);
+    ASSERT_EQ(records[0].key, "foo3");
+
+    // entries appended to the open log file are picked up
+    ASSERT_EQ(tail.read(records), 0);
+    db.put("foo4", "bar4");
+    ASSERT_EQ(tail.read(records), 1);
+    ASSERT_EQ(records[1].key, "foo4");
+    db.close();
+}
+
+TEST(ChangeStream, Follower)
+{
+    auto dir = createTestDataDir();
+    auto replicaDir = createTestDataDir();
+    bitcask::BitcaskDb db;
+    db.open(dir);
+    db.put("foo", "bar");
+
+    bitcask::BitcaskFollower follower;
+    follower.open(dir, replicaDir);
+    ASSERT_EQ(follower.poll(), 1);
+    ASSERT_EQ(follower.replica().getString("foo"), "bar");
+
+    db.rotateCurrentLogFile();
+    db.put("foo", "baz");
+    db.put("foo1", "bar1");
+    ASSERT_EQ(follower.poll(), 2);
+    ASSERT_EQ(follower.replica().getString("foo"), "baz");
+    ASSERT_EQ(follower.replica().getString("foo1"), "bar1");
+    follower.close();
+
+    // the follower resumes at the stored position
+    db.put("foo2", "bar2");
+    follower = bitcask::BitcaskFollower();
+    follower.open(dir, replicaDir);
+    ASSERT_EQ(follower.poll(), 1);
+    ASSERT_EQ(follower.replica().getString("foo"), "baz");
+    ASSERT_EQ(follower.replica().getString("foo2"), "bar2");
+    ASSERT_EQ(follower.poll(), 0);
+    follower.close();
+    db.close();
+}
+
+TEST(ChangeStream, FollowerMirrorsEmptySegments)
+{
+    auto dir = createTestDataDir();
+    auto replicaDir = createTestDataDir();
+    bitcask::BitcaskDb db;
+    db.open(dir);
+    db.put("foo", "bar");
+    db.rotateCurrentLogFile();
+    db.rotateCurrentLogFile();
+    db.rotateCurrentLogFile();
+    db.put("foo1", "bar1");
+
+    bitcask::BitcaskFollower follower;
+    follower.open(dir, replicaDir);
+    ASSERT_EQ(follower.poll(), 2);
+    ASSERT_EQ(follower.replica().getString("foo1"), "bar1");
+    follower.close();
+    db.close();
+
+    for (int nr = 0; nr < 3; nr++)
+    {
+        ASSERT_TRUE(std::filesystem::exists(replicaDir / (std::to_string(nr) + ".log")));
+    }
+    ASSERT_FALSE(std::filesystem::exists(replicaDir / "3.log"));
+}
+
+TEST(OpenDB, RebuildIndexes)
+{
+    auto dir = createTestDataDir();
+    bitcask::BitcaskDb db;
+    db.open(dir);
+
+    for (int segment = 0; segment < 6; segment++)
+    {
+        for (int i = 0; i < 20; i++)
+        {
+            db.put("key" + std::to_string(i), "value" + std::to_string(segment) + "-" + std::to_string(i));
+        }
+        db.put("segment" + std::to_string(segment), "bar");
+        db.rotateCurrentLogFile();
+    }
+    db.put("foo", "bar");
+    db.close();
+
+    // simulate a crash after renaming current.log, an incomplete index and a leftover temporary file
+    std::filesystem::remove(dir / "5.idx");
+    std::filesystem::remove(dir / "2.idx");
+    std::filesystem::resize_file(dir / "3.idx", 10);
+    std::filesystem::copy_file(dir / "1.idx", dir / "1.idx.tmp");
+
+    db = bitcask::BitcaskDb();
+    db.open(dir);
+    ASSERT_EQ(db.getString("key0"), "value5-0");
+    ASSERT_EQ(db.getString("key19"), "value5-19");
+    for (int segment = 0; segment < 6; segment++)
+    {
+        ASSERT_EQ(db.getString("segment" + std::to_string(segment)), "bar");
+    }
+    ASSERT_EQ(db.getString("foo"), "bar");
+    db.close();
+
+    ASSERT_TRUE(std::filesystem::exists(dir / "5.idx"));
+    ASSERT_TRUE(std::filesystem::exists(dir / "2.idx"));
+
+    db = bitcask::BitcaskDb();
+    db.open(dir);
+    ASSERT_EQ(db.getString("key7"), "value5-7");
+    ASSERT_EQ(db.getString("segment3"), "bar");
+    db.close();
+}
+
+TEST(OpenDB, RebuildIndexesWithoutClose)
+{
+    auto dir = createTestDataDir();
+    {
+        bitcask::BitcaskDb db;
+        db.open(dir);
+        db.put("foo", "bar");
+        db.rotateCurrentLogFile();
+
+        // an expired entry in the current log hides the entry of the segment being rebuilt
+        db.put("foo", "baz", std::chrono::milliseconds(1));
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        db.close();
+    }
+    std::filesystem::remove(dir / "0.idx");
+
+    {
+        bitcask::BitcaskDb db;
+        db.open(dir);
+        std::string result;
+        ASSERT_FALSE(db.get("foo", result));
+        db.close();
+    }
+
+    // the DB is moved while the index is rebuilt
+    std::filesystem::remove(dir / "0.idx");
+    {
+        bitcask::BitcaskDb db;
+        db.open(dir);
+        bitcask::BitcaskDb moved = std::move(db);
+        std::string result;
+        ASSERT_FALSE(moved.get("foo", result));
+        moved.close();
+    }
+
+    // closing doesn't wait for pending rebuilds, they are done on the next open
+    std::filesystem::remove(dir / "0.idx");
+    {
+        bitcask::BitcaskDb db;
+        db.open(dir);
+        db.close();
+        db.open(dir);
+        std::string result;
+        ASSERT_FALSE(db.get("foo", result));
+        db.close();
+    }
+
+    // the DB is destroyed while the index is rebuilt
+    std::filesystem::remove(dir / "0.idx");
+    {
+        bitcask::BitcaskDb db;
+        db.open(dir);
+    }
+}